@@ -7,9 +7,26 @@
 #include <algorithm>
 #include <cstdint>
 #include <array>
+#include <limits>
 #include <iomanip>
 #include <random>
 #include <mutex>
+#include <atomic>
+#include <map>
+#include <thread>
+#include <functional>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 // CRC32 table
@@ -17,9 +34,9 @@ uint32_t crc32_table[256];
 uint16_t crc16_table[256];
 uint8_t crc8_table[256];
 
-uint8_t* split32To8(uint32_t value)
+array<uint8_t, 4> split32To8(uint32_t value)
 {
-    uint8_t* bytes = new uint8_t[4];
+    array<uint8_t, 4> bytes;
     bytes[0] = (value >> 24) & 0xFF; // Most significant byte (MSB)
     bytes[1] = (value >> 16) & 0xFF;
     bytes[2] = (value >> 8) & 0xFF;
@@ -158,13 +175,254 @@ unsigned char reswapNibbles(int mode, unsigned char value)
     }
 }
 
+
 string byteToBinaryString(unsigned char b)
 {
     bitset<8> bits(b);
     return bits.to_string();
 }
 
-vector<unsigned char> readFile(const string& filename)
+// Buffer pool
+//
+// Every file used to get three freshly allocated, zero-filled vectors (input,
+// output and the decoded name). The pool hands out uninitialized page-aligned
+// buffers instead and keeps released ones around, so a batch of files (or
+// several threads) keeps reusing the same memory instead of going back to the
+// allocator and faulting in new pages for every file.
+
+const size_t POOL_MIN_BUFFER = 64 * 1024;
+const size_t POOL_HUGE_PAGE = 2 * 1024 * 1024;
+const size_t POOL_MAX_KEPT_BUFFER = 256 * 1024 * 1024; // bigger buffers are freed on release
+const size_t POOL_MAX_IDLE_BYTES = 1024 * 1024 * 1024; // total kept around between files
+
+#ifdef _WIN32
+// Large pages need SeLockMemoryPrivilege, and holding it is not enough: it has
+// to be enabled in the process token first. Accounts without it keep normal pages.
+bool enableLargePages()
+{
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return false;
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+        GetLastError() == ERROR_SUCCESS; // ERROR_NOT_ALL_ASSIGNED if the account lacks it
+    CloseHandle(token);
+    return enabled;
+}
+
+bool largePagesEnabled()
+{
+    static const bool enabled = enableLargePages();
+    return enabled;
+}
+#endif
+
+void* allocatePages(size_t size)
+{
+#ifdef _WIN32
+    SIZE_T largePage = GetLargePageMinimum();
+    if (largePagesEnabled() && largePage != 0 && size % largePage == 0)
+    {
+        void* pages = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (pages)
+            return pages;
+    }
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* pages = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (size % POOL_HUGE_PAGE == 0)
+        pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (pages == MAP_FAILED)
+    {
+        pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED)
+            return nullptr;
+#ifdef MADV_HUGEPAGE
+        if (size >= POOL_HUGE_PAGE)
+            madvise(pages, size, MADV_HUGEPAGE);
+#endif
+    }
+    return pages;
+#endif
+}
+
+void freePages(void* pages, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(pages, 0, MEM_RELEASE);
+#else
+    munmap(pages, size);
+#endif
+}
+
+class BufferPool
+{
+public:
+    BufferPool() : idleBytes(0), allocationCount(0), reuseCount(0)
+    {
+#ifdef _WIN32
+        largePagesEnabled();
+#endif
+    }
+
+    ~BufferPool()
+    {
+        for (auto& buffer : idle)
+        {
+            freePages(buffer.second, buffer.first);
+        }
+    }
+
+    // Small buffers are rounded up to 64 KB and large ones to a huge page, so a
+    // buffer never commits more than one step past what was asked for. An idle
+    // buffer is reused if it is at most an eighth bigger than needed.
+    unsigned char* acquire(size_t size, size_t& capacity)
+    {
+        size_t step = size < POOL_HUGE_PAGE ? POOL_MIN_BUFFER : POOL_HUGE_PAGE;
+        if (size > SIZE_MAX - step)
+            throw bad_alloc();
+        capacity = max((size + step - 1) / step * step, POOL_MIN_BUFFER);
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto fit = idle.lower_bound(capacity);
+            if (fit != idle.end() && fit->first <= capacity + capacity / 8)
+            {
+                unsigned char* buffer = fit->second;
+                capacity = fit->first;
+                idleBytes -= capacity;
+                idle.erase(fit);
+                reuseCount++;
+                return buffer;
+            }
+        }
+
+        unsigned char* buffer = static_cast<unsigned char*>(allocatePages(capacity));
+        if (!buffer)
+            throw bad_alloc();
+        allocationCount++;
+        return buffer;
+    }
+
+    void release(unsigned char* buffer, size_t capacity)
+    {
+        if (capacity <= POOL_MAX_KEPT_BUFFER)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (idleBytes + capacity <= POOL_MAX_IDLE_BYTES)
+            {
+                idle.insert(make_pair(capacity, buffer));
+                idleBytes += capacity;
+                return;
+            }
+        }
+        freePages(buffer, capacity);
+    }
+
+    size_t allocations() const { return allocationCount; }
+    size_t reuses() const { return reuseCount; }
+
+private:
+    std::mutex mtx;
+    multimap<size_t, unsigned char*> idle;
+    size_t idleBytes;
+    atomic<size_t> allocationCount;
+    atomic<size_t> reuseCount;
+};
+
+BufferPool bufferPool;
+
+// Uninitialized byte buffer borrowed from bufferPool, returned when it goes out of scope.
+class PooledBuffer
+{
+public:
+    PooledBuffer() : buffer(nullptr), length(0), capacity(0) {}
+
+    explicit PooledBuffer(size_t size) : length(size)
+    {
+        buffer = bufferPool.acquire(size, capacity);
+    }
+
+    PooledBuffer(PooledBuffer&& other) : buffer(other.buffer), length(other.length), capacity(other.capacity)
+    {
+        other.buffer = nullptr;
+        other.length = 0;
+    }
+
+    PooledBuffer& operator=(PooledBuffer&& other)
+    {
+        if (this != &other)
+        {
+            if (buffer)
+                bufferPool.release(buffer, capacity);
+            buffer = other.buffer;
+            length = other.length;
+            capacity = other.capacity;
+            other.buffer = nullptr;
+            other.length = 0;
+        }
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    ~PooledBuffer()
+    {
+        if (buffer)
+            bufferPool.release(buffer, capacity);
+    }
+
+    unsigned char* data() { return buffer; }
+    const unsigned char* data() const { return buffer; }
+    size_t size() const { return length; }
+    unsigned char& operator[](size_t i) { return buffer[i]; }
+    const unsigned char& operator[](size_t i) const { return buffer[i]; }
+
+private:
+    unsigned char* buffer;
+    size_t length;
+    size_t capacity;
+};
+
+bool isRegularFile(const string& filename)
+{
+#ifdef _WIN32
+    struct _stat64 info;
+    return _stat64(filename.c_str(), &info) == 0 && (info.st_mode & _S_IFMT) == _S_IFREG;
+#else
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+#endif
+}
+
+// Size of an opened file, which is left positioned at its start. Directories and
+// devices open fine as streams but have no usable size, so they are refused.
+uint64_t getFileSize(ifstream& file, const string& filename)
+{
+    if (!isRegularFile(filename))
+    {
+        throw runtime_error("Not a regular file");
+    }
+
+    file.seekg(0, ios::end);
+    streamoff fileSize = file.tellg();
+    file.seekg(0, ios::beg);
+    if (fileSize < 0 || !file)
+    {
+        throw runtime_error("Could not read file");
+    }
+    return static_cast<uint64_t>(fileSize);
+}
+
+PooledBuffer readFile(const string& filename)
 {
     ifstream file(filename, ios::binary);
     if (!file)
@@ -172,24 +430,30 @@ vector<unsigned char> readFile(const string& filename)
         throw runtime_error("Could not open file");
     }
 
-    file.seekg(0, ios::end);
-    streampos fileSize = file.tellg();
-    file.seekg(0, ios::beg);
+    uint64_t fileSize = getFileSize(file, filename);
+    if (fileSize > SIZE_MAX)
+    {
+        throw runtime_error("File too large");
+    }
 
-    vector<unsigned char> data(fileSize);
-    file.read(reinterpret_cast<char*>(data.data()), fileSize);
+    PooledBuffer data(static_cast<size_t>(fileSize));
+    file.read(reinterpret_cast<char*>(data.data()), static_cast<streamsize>(fileSize));
+    if (static_cast<uint64_t>(file.gcount()) != fileSize)
+    {
+        throw runtime_error("Could not read file");
+    }
 
     return data;
 }
 
-void writeFile(const string& filename, const vector<unsigned char>& data)
+void writeFile(const string& filename, const unsigned char* data, size_t size)
 {
     ofstream file(filename, ios::binary);
     if (!file)
     {
         throw runtime_error("Could not create file");
     }
-    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.write(reinterpret_cast<const char*>(data), size);
 }
 
 string getOutputFilename(const string& inputFilename)
@@ -204,516 +468,1106 @@ void split16To8(uint16_t value, uint8_t& highByte, uint8_t& lowByte) {
     lowByte = value & 0xFF;          // Get lower 8 bits
 }
 
-int main(int argc, char* argv[])
+// Key schedule for one 32-byte block: the swapNibbles mode used at each position.
+// Only positions 0-7 take a bit from the key. Positions 8-31 looked up their bit
+// past the end of the 8-character key strings and every archive that packed
+// without throwing used mode 0 there, so that is what they stay.
+void buildKeySchedule(uint8_t key, uint8_t modes[32])
 {
-    generate_crc32_table();
-    string appmode = "";
+    string bitsBinKey = byteToBinaryString(key);
+    for (int x = 0; x < 32; x++)
+    {
+        modes[x] = (x < 8 && bitsBinKey[x] == '1') ? x : 0;
+    }
+}
 
-    if (globalmode == 1)
+void packBytes(const unsigned char* in, unsigned char* out, size_t count, const uint8_t modes[32])
+{
+    for (size_t k = 0; k < count; k++)
     {
-        appmode = "(unpack mode)";
+        out[k] = swapNibbles(modes[k % 32], in[k]);
     }
-    else if (globalmode == 2)
+}
+
+void unpackBytes(const unsigned char* in, unsigned char* out, size_t count, const uint8_t modes[32])
+{
+    for (size_t k = 0; k < count; k++)
     {
-        appmode = "(pack mode)";
+        out[k] = reswapNibbles(modes[k % 32], in[k]);
     }
-    std::cout << "LeafPack (https://github.com/greensci/leafpack)\nby greensci (https://github.com/greensci)\n" << appmode << endl;
+}
 
+// Key bytes and trailer checksum of a password protected file.
+// crc16_table is never generated, so the first two key bytes always come out as
+// zero; existing password protected files depend on that.
+void passwordKeys(const string& password, uint8_t keys[4], array<uint8_t, 4>& passcheckumbytes)
+{
+    passcheckumbytes = split32To8(crc32(password));
+    split16To8(crc16(password), keys[0], keys[1]);
+    keys[2] = crc8(password);
+    keys[3] = (passcheckumbytes[1] << 4) | (passcheckumbytes[1] >> 4);
+}
 
-    if (argc < 2)
+// Packed layout: "LPK1", four key bytes, name length (including the NUL), a flag
+// byte (<= 0x45 means password protected), the packed name, then the packed data
+// starting on top of the name's NUL byte, then the password checksum if any.
+PooledBuffer packData(const string& name, const PooledBuffer& data, bool usePassword, const string& password)
+{
+    size_t length = name.size() + 1;
+    size_t passwordLength = usePassword ? 4 : 0;
+    if (length > 255)
+    {
+        throw runtime_error("File name too long");
+    }
+
+    // The packed data starts on top of the name's NUL byte and its last two bytes
+    // never fit, so anything shorter than that would lose the end of the name.
+    if (data.size() < 2)
     {
-        cerr << "Usage: leafpack <argument> <inputfile>" << endl;
-        cerr << "Options:" << endl;
+        throw runtime_error("File is too small to pack (at least 2 bytes needed)");
+    }
 
-        cerr << "  -p : Pack the input file" << endl;
-        cerr << "  -d : Unpack the input file" << endl;
-        std::string hi;
-        std::getline(std::cin, hi);
+    size_t packedSize = data.size() + 7 + length + passwordLength;
+    PooledBuffer packedData(packedSize);
 
-        return 1;
+    packedData[0] = 0x4C; // 'L'
+    packedData[1] = 0x50; // 'P'
+    packedData[2] = 0x4B; // 'K'
+    packedData[3] = 0x31; // Version 1
+
+    uint8_t keys[4];
+    for (int k = 0; k < 4; k++)
+    {
+        keys[k] = generateRandom(0, 253);
+        packedData[4 + k] = keys[k];
     }
-  
+    packedData[8] = length;
 
-    if (std::string(argv[1]).find(".lpk") != std::string::npos)
+    array<uint8_t, 4> passcheckumbytes = {};
+    if (usePassword)
     {
-        globalmode = 1;
+        packedData[9] = generateRandom(0, 68);
+        passwordKeys(password, keys, passcheckumbytes);
     }
-    else if (std::string(argv[1]) == "-p")
+    else
     {
+        // 0x45 itself reads as password protected, so leave it out.
+        packedData[9] = generateRandom(0x46, 254);
     }
-    else if (std::string(argv[1]) == "-pp")
+
+    uint8_t modes[32];
+    buildKeySchedule(keys[0], modes);
+
+    size_t bodyEnd = packedSize - passwordLength;
+    packBytes(reinterpret_cast<const unsigned char*>(name.c_str()), packedData.data() + 10, length - 1, modes);
+
+    size_t dataStart = 9 + length;
+    size_t dataCount = bodyEnd - dataStart;
+    packBytes(data.data(), packedData.data() + dataStart, dataCount, modes);
+
+    if (usePassword)
     {
+        copy(passcheckumbytes.begin(), passcheckumbytes.end(), packedData.data() + bodyEnd);
     }
-    else if (std::string(argv[1]) == "-d")
+    return packedData;
+}
+
+void packFile(const string& arg2, bool usePassword, const string& password)
+{
+    PooledBuffer data = readFile(arg2);
+
+    std::cout << "Packing file..." << endl;
+    PooledBuffer packedData = packData(arg2, data, usePassword, password);
+
+    // Save the packed data
+    string outputFilename = getOutputFilename(arg2);
+    writeFile(outputFilename, packedData.data(), packedData.size());
+    std::cout << "File packed successfully to " << outputFilename << endl;
+}
+
+void checkPackedData(const PooledBuffer& data)
+{
+    if (data.size() < 10 || data.size() < 9 + size_t(data[8]))
     {
+        throw runtime_error("Not a LeafPack file");
     }
-    else
+}
+
+// Unpacks data with the given key byte and returns the stored file name.
+string unpackData(const PooledBuffer& data, uint8_t key, PooledBuffer& unpackedData)
+{
+    size_t length = data[8];
+    unpackedData = PooledBuffer(data.size() - (7 + length));
+
+    uint8_t modes[32];
+    buildKeySchedule(key, modes);
+
+    string filename(min<size_t>(length > 0 ? length - 1 : 0, data.size() - 10), '\0');
+    unpackBytes(data.data() + 10, reinterpret_cast<unsigned char*>(&filename[0]), filename.size(), modes);
+
+    // The last four bytes are never unpacked; whatever they leave short of the
+    // output size has always come out as zeros.
+    size_t dataStart = 9 + length;
+    size_t dataCount = data.size() - 4 > dataStart ? data.size() - 4 - dataStart : 0;
+    unpackBytes(data.data() + dataStart, unpackedData.data(), dataCount, modes);
+    memset(unpackedData.data() + dataCount, 0, unpackedData.size() - dataCount);
+    return filename;
+}
+
+// Runs task(0) .. task(count - 1) spread over all cores, or over at most
+// threadLimit threads if one is given.
+void parallelFor(size_t count, const function<void(size_t)>& task, size_t threadLimit = 0)
+{
+    size_t threadCount = min<size_t>(max(1u, thread::hardware_concurrency()), count);
+    if (threadLimit > 0)
+        threadCount = min(threadCount, threadLimit);
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (size_t t = 0; t < threadCount; t++)
     {
-        globalmode = 2;
+        workers.emplace_back([&]()
+        {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                task(i);
+            }
+        });
     }
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+}
 
-    
-    if (std::string(argv[1]) == "-p" || globalmode == 2)
+struct ArchiveInfo
+{
+    string path;
+    string error;             // set if the header could not be read
+    uint8_t version = 0;
+    bool passwordProtected = false;
+    string filename;          // left empty for password protected files
+    array<uint8_t, 4> passwordChecksum = {}; // trailer of password protected files
+    uint64_t packedSize = 0;
+    uint64_t unpackedSize = 0;
+};
+
+// Reads what a packed file contains from its header and name (at most 265 bytes)
+// and, for password protected files, the 4-byte trailer, without touching the
+// packed data.
+ArchiveInfo readArchiveInfo(const string& path)
+{
+    ArchiveInfo info;
+    info.path = path;
+
+    ifstream file(path, ios::binary);
+    if (!file)
     {
-        std::cout << "Pack file:" << endl;
+        info.error = "Could not open file";
+        return info;
+    }
 
-        try
+    try
+    {
+        info.packedSize = getFileSize(file, path);
+    }
+    catch (const exception& e)
+    {
+        info.error = e.what();
+        return info;
+    }
+
+    unsigned char header[10 + 255];
+    if (info.packedSize < 10 || !file.read(reinterpret_cast<char*>(header), 10) ||
+        header[0] != 0x4C || header[1] != 0x50 || header[2] != 0x4B)
+    {
+        info.error = "Not a LeafPack file";
+        return info;
+    }
+
+    if (header[3] != 0x31)
+    {
+        info.error = "Unsupported LeafPack version";
+        return info;
+    }
+
+    size_t length = header[8];
+    info.version = header[3];
+    info.passwordProtected = header[9] <= 0x45;
+    if (info.packedSize < 9 + length)
+    {
+        info.error = "Not a LeafPack file";
+        return info;
+    }
+    info.unpackedSize = info.packedSize - (7 + length);
+
+    if (info.passwordProtected)
+    {
+        file.seekg(static_cast<streamoff>(info.packedSize - 4), ios::beg);
+        if (!file.read(reinterpret_cast<char*>(info.passwordChecksum.data()), 4))
         {
+            info.error = "Could not read file";
+        }
+        return info;
+    }
 
-            std::string arg2;
-            if (globalmode == 2)
-                arg2 = argv[1];
-            else
-                arg2 = argv[2];
+    size_t nameCount = length > 0 ? length - 1 : 0;
+    nameCount = min<uint64_t>(nameCount, info.packedSize - 10);
+    if (nameCount > 0)
+    {
+        file.read(reinterpret_cast<char*>(header + 10), nameCount);
+
+        uint8_t modes[32];
+        buildKeySchedule(header[4], modes);
+        info.filename.assign(nameCount, '\0');
+        unpackBytes(header + 10, reinterpret_cast<unsigned char*>(&info.filename[0]), nameCount, modes);
+    }
+    return info;
+}
+
+vector<ArchiveInfo> readArchiveInfos(const vector<string>& paths)
+{
+    vector<ArchiveInfo> infos(paths.size());
+    parallelFor(paths.size(), [&](size_t i)
+    {
+        infos[i] = readArchiveInfo(paths[i]);
+    });
+    return infos;
+}
+
+// Returns false if the password was wrong. The password is checked against the
+// header and trailer alone, so a wrong one never reads the packed data.
+bool unpackFile(const string& inputFilename)
+{
+    ArchiveInfo info = readArchiveInfo(inputFilename);
+    if (!info.error.empty())
+    {
+        throw runtime_error(info.error);
+    }
+
+    uint8_t key = 0;
+    if (info.passwordProtected)
+    {
+        std::string password;
+        std::cout << "Enter a password for the packed file: \n";
+        std::getline(std::cin, password);
+
+        uint8_t keys[4];
+        array<uint8_t, 4> passcheckumbytes;
+        passwordKeys(password, keys, passcheckumbytes);
+        key = keys[0];
+
+        if (passcheckumbytes == info.passwordChecksum)
+        {
+            std::cout << "Password is correct, unpacking..." << endl;
+        }
+        else
+        {
+            std::cout << "Password is incorrect, aborting unpacking." << endl;
+            return false;
+        }
+    }
 
-            size_t length = arg2.size() + 1; // Now you can use .size()
+    PooledBuffer data = readFile(inputFilename);
+    checkPackedData(data);
+    if (!info.passwordProtected)
+    {
+        key = data[4];
+    }
 
-            vector<unsigned char> data = readFile(arg2);
-            vector<unsigned char> packedData((data.size() + 7) + length);
+    std::cout << "Unpacking file..." << endl;
+    PooledBuffer unpackedData;
+    string filename = unpackData(data, key, unpackedData);
 
-            packedData[0] = 0x4C; // 'L'
-            packedData[1] = 0x50; // 'P'
-            packedData[2] = 0x4B; // 'K'
-            packedData[3] = 0x31; // Version 1
+    writeFile(filename, unpackedData.data(), unpackedData.size());
+    std::cout << "File unpacked successfully to " << filename << endl;
+    return true;
+}
 
-            unsigned char bitter = generateRandom(0, 253);
+// Tests one password against many packed files at once, reading only their
+// headers and trailers. Returns false if it is wrong for any of them or one
+// could not be read.
+bool checkPassword(const vector<string>& paths, const string& password)
+{
+    uint8_t keys[4];
+    array<uint8_t, 4> passcheckumbytes;
+    passwordKeys(password, keys, passcheckumbytes);
 
-            unsigned char bitter2 = generateRandom(0, 253);// Binary literal (C++14)
+    vector<ArchiveInfo> infos = readArchiveInfos(paths);
 
-            unsigned char bitter3 = generateRandom(0, 253);// Binary literal (C++14)
+    ostringstream out;
+    bool allCorrect = true;
+    for (const ArchiveInfo& info : infos)
+    {
+        out << info.path << ": ";
+        if (!info.error.empty())
+        {
+            out << info.error;
+            allCorrect = false;
+        }
+        else if (!info.passwordProtected)
+        {
+            out << "not password protected";
+        }
+        else if (info.passwordChecksum == passcheckumbytes)
+        {
+            out << "password is correct";
+        }
+        else
+        {
+            out << "password is incorrect";
+            allCorrect = false;
+        }
+        out << endl;
+    }
+    std::cout << out.str();
+    return allCorrect;
+}
 
-            unsigned char bitter4 = generateRandom(0, 253);// Binary literal (C++14)
-            packedData[4] = bitter;
-            packedData[5] = bitter2;
-            packedData[6] = bitter3;
-            packedData[7] = bitter4;
-            packedData[8] = length;
-            packedData[9] = generateRandom(0x45, 254);
+// Length of the valid UTF-8 sequence starting at text[i], or 0 if there is none.
+size_t utf8SequenceLength(const string& text, size_t i)
+{
+    unsigned char c = text[i];
+    size_t length;
+    unsigned char low = 0x80, high = 0xBF; // allowed range of the second byte
+    if (c >= 0xC2 && c <= 0xDF)
+        length = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        length = 3;
+        if (c == 0xE0)
+            low = 0xA0;  // overlong
+        else if (c == 0xED)
+            high = 0x9F; // surrogates
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        length = 4;
+        if (c == 0xF0)
+            low = 0x90;  // overlong
+        else if (c == 0xF4)
+            high = 0x8F; // past U+10FFFF
+    }
+    else
+        return 0;
 
-            string bitsBinKey = byteToBinaryString(bitter);
-            string bitsBinKey2 = byteToBinaryString(bitter2);
-            string bitsBinKey3 = byteToBinaryString(bitter3);
-            string bitsBinKey4 = byteToBinaryString(bitter4);
+    if (i + length > text.size())
+        return 0;
+    for (size_t k = 1; k < length; k++)
+    {
+        unsigned char next = text[i + k];
+        if (next < (k == 1 ? low : 0x80) || next > (k == 1 ? high : 0xBF))
+            return 0;
+    }
+    return length;
+}
 
-            // std::cout << "Key bits: " << bitsBinKey << endl;
-            std::cout << "Packing file..." << endl;
+// Stored names are raw bytes. Valid UTF-8 passes through as is; any other byte
+// of 0x80 and up is written as \u00XX, i.e. read as Latin-1.
+string jsonEscape(const string& text)
+{
+    ostringstream out;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        unsigned char c = text[i];
+        size_t length = c >= 0x80 ? utf8SequenceLength(text, i) : 0;
+        if (length > 0)
+        {
+            out << text.substr(i, length);
+            i += length - 1;
+        }
+        else if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20 || c >= 0x80)
+            out << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec;
+        else
+            out << c;
+    }
+    return out.str();
+}
 
+void printArchiveInfos(const vector<ArchiveInfo>& infos, bool json)
+{
+    ostringstream out;
+    if (json)
+        out << "[" << endl;
 
-            for (int i = 10; i < (length + 10) - 1; i += 32)
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+        const ArchiveInfo& info = infos[i];
+        if (json)
+        {
+            out << "  {\"path\": \"" << jsonEscape(info.path) << "\"";
+            if (!info.error.empty())
             {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= (10 + length))
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = swapNibbles(x, arg2[(i + x) - 10]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = swapNibbles(0, arg2[(i + x) - 10]);
-                    }
-
-                    packedData[i + x] = byter;
-                }
+                out << ", \"error\": \"" << jsonEscape(info.error) << "\"";
             }
-
-            for (int i = 9 + length; i < (data.size() + 9) + length; i += 32)
+            else
             {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= data.size() + (9 + length))
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = swapNibbles(x, data[(i + x) - (9 + length)]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = swapNibbles(0, data[(i + x) - (9 + length)]);
-                    }
-
-                    packedData[i + x] = byter;
-                }
+                out << ", \"format\": \"LPK" << char(info.version) << "\""
+                    << ", \"password\": " << (info.passwordProtected ? "true" : "false");
+                if (!info.passwordProtected)
+                    out << ", \"name\": \"" << jsonEscape(info.filename) << "\"";
+                out << ", \"packedSize\": " << info.packedSize
+                    << ", \"size\": " << info.unpackedSize;
             }
+            out << "}" << (i + 1 < infos.size() ? "," : "") << endl;
+        }
+        else if (!info.error.empty())
+        {
+            out << info.path << ": " << info.error << endl;
+        }
+        else
+        {
+            out << info.path << ": "
+                << (info.passwordProtected ? "(password protected)" : info.filename)
+                << ", " << info.unpackedSize << " bytes (" << info.packedSize << " packed), LPK"
+                << char(info.version) << endl;
+        }
+    }
+
+    if (json)
+        out << "]" << endl;
+    std::cout << out.str();
+}
+
+// Split files
+//
+// -s cuts one input into shards of a given size. Each shard is an ordinary packed
+// file of its own, so any machine can unpack any shard, and a manifest (.lpkm)
+// records where each shard belongs. Unpacking the manifest unpacks all shards in
+// parallel straight into their place in one preallocated output file; -ds unpacks
+// single shards to exactly their part of the original file.
+
+// unpackFile has always left the last six bytes of a file as zeros, so every
+// shard carries six bytes of padding after its part of the input.
+const size_t SHARD_PADDING = 6;
+
+struct ShardEntry
+{
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    string filename; // relative to the manifest
+};
+
+struct Manifest
+{
+    string filename; // relative to the manifest
+    uint64_t fileSize = 0;
+    vector<ShardEntry> shards;
+};
+
+string directoryOf(const string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    return (slash != string::npos) ? path.substr(0, slash + 1) : "";
+}
+
+string baseNameOf(const string& path)
+{
+    return path.substr(directoryOf(path).size());
+}
+
+string getShardName(const string& name, size_t index)
+{
+    ostringstream shardName;
+    shardName << name << "." << setw(3) << setfill('0') << index;
+    return shardName.str();
+}
 
-            // Save the packed data
-            string outputFilename = getOutputFilename(arg2);
-            writeFile(outputFilename, packedData);
-            std::cout << "File packed successfully to " << outputFilename << endl;
+void readFileRange(const string& filename, uint64_t offset, unsigned char* data, size_t size)
+{
+    ifstream file(filename, ios::binary);
+    if (!file)
+    {
+        throw runtime_error("Could not open file");
+    }
+    file.seekg(static_cast<streamoff>(offset), ios::beg);
+    file.read(reinterpret_cast<char*>(data), size);
+    if (static_cast<size_t>(file.gcount()) != size)
+    {
+        throw runtime_error("Could not read file");
+    }
+}
+
+void writeFileRange(const string& filename, uint64_t offset, const unsigned char* data, size_t size)
+{
+    fstream file(filename, ios::in | ios::out | ios::binary);
+    if (!file)
+    {
+        throw runtime_error("Could not open file");
+    }
+    file.seekp(static_cast<streamoff>(offset), ios::beg);
+    file.write(reinterpret_cast<const char*>(data), size);
+    if (!file)
+    {
+        throw runtime_error("Could not write file");
+    }
+}
+
+// Memory that can be handed out without swapping, counting page cache the
+// system can drop. Splitting or joining a big file fills the cache, so free
+// memory alone would be close to zero right when it matters.
+uint64_t availableMemory()
+{
+#ifdef _WIN32
+    // ullAvailPhys already counts the standby (cache) list.
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return status.ullAvailPhys;
+#else
+    ifstream meminfo("/proc/meminfo");
+    string field;
+    uint64_t kilobytes;
+    while (meminfo >> field >> kilobytes)
+    {
+        if (field == "MemAvailable:")
+            return kilobytes * 1024;
+        meminfo.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+
+    // No MemAvailable (not Linux, or a very old kernel): go by total memory.
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0)
+        return static_cast<uint64_t>(pages) * static_cast<uint64_t>(pageSize);
+#endif
+    return 0;
+}
+
+// Runs task(i) for every shard and rethrows the first error any of them hit,
+// prefixed with the shard's file name. Each shard holds about two shard-sized
+// buffers while it runs, so no more run at once than fit in half of the available
+// memory.
+void forEachShard(const vector<ShardEntry>& shards, uint64_t shardSize, const function<void(size_t)>& task)
+{
+    size_t threadLimit = 0;
+    uint64_t memory = availableMemory();
+    if (memory > 0)
+    {
+        threadLimit = static_cast<size_t>(max<uint64_t>(memory / 2 / (2 * max<uint64_t>(shardSize, 1)), 1));
+        if (threadLimit < min<size_t>(max(1u, thread::hardware_concurrency()), shards.size()))
+        {
+            std::cout << "Running " << threadLimit << " shard(s) at a time to fit in "
+                      << memory / (1024 * 1024) << " MB of available memory" << endl;
+        }
+    }
+
+    string error;
+    std::mutex errorMutex;
+    parallelFor(shards.size(), [&](size_t i)
+    {
+        try
+        {
+            task(i);
         }
         catch (const exception& e)
         {
-            cerr << "Error: " << e.what() << endl;
-            return 1;
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (error.empty())
+                error = shards[i].filename + ": " + e.what();
         }
+    }, threadLimit);
+    if (!error.empty())
+    {
+        throw runtime_error(error);
     }
-    else if (std::string(argv[1]) == "-pp" || globalmode == 2)
+}
+
+void splitFile(const string& inputFilename, uint64_t shardSize)
+{
+    uint64_t fileSize;
     {
-        std::cout << "Pack file with password:" << endl;
-        generate_crc8_table();
-        try
+        ifstream file(inputFilename, ios::binary);
+        if (!file)
         {
-            std::string password;
-            std::cout << "Enter a password for the packed file: \n";
-            std::getline(std::cin, password);
-            uint32_t passchecksum = crc32(password);
+            throw runtime_error("Could not open file");
+        }
+        fileSize = getFileSize(file, inputFilename);
+    }
 
-            int passwordLength = 4;
+    string outputFilename = getOutputFilename(inputFilename);
+    string outputBase = baseNameOf(outputFilename.substr(0, outputFilename.size() - 4));
+    string outputDirectory = directoryOf(outputFilename);
+    string name = baseNameOf(inputFilename);
 
-            uint8_t* passcheckumbytes = split32To8(passchecksum);
+    // Every shard file comes out at exactly shardSize bytes (the last one may be
+    // smaller), so a shard's buffers stay within one pool size step of it.
+    vector<ShardEntry> shards;
+    uint64_t offset = 0;
+    do
+    {
+        size_t overhead = 7 + getShardName(name, shards.size()).size() + 1 + SHARD_PADDING;
+        if (shardSize <= overhead)
+        {
+            throw runtime_error("Shard size too small");
+        }
+
+        ShardEntry shard;
+        shard.offset = offset;
+        shard.size = min(shardSize - overhead, fileSize - offset);
+        shard.filename = getShardName(outputBase, shards.size()) + ".lpk";
+        shards.push_back(shard);
+        offset += shard.size;
+    } while (offset < fileSize);
 
-            std::string arg2 = argv[2];
+    std::cout << "Splitting file into " << shards.size() << " shards..." << endl;
 
-            size_t length = arg2.size() + 1; // Now you can use .size()
+    forEachShard(shards, shardSize, [&](size_t i)
+    {
+        const ShardEntry& shard = shards[i];
+        PooledBuffer data(static_cast<size_t>(shard.size) + SHARD_PADDING);
+        readFileRange(inputFilename, shard.offset, data.data(), static_cast<size_t>(shard.size));
+        memset(data.data() + shard.size, 0, SHARD_PADDING);
+
+        PooledBuffer packedData = packData(getShardName(name, i), data, false, "");
+        writeFile(outputDirectory + shard.filename, packedData.data(), packedData.size());
+    });
+
+    string manifestFilename = outputFilename + "m";
+    ofstream manifest(manifestFilename);
+    if (!manifest)
+    {
+        throw runtime_error("Could not create file");
+    }
+    manifest << "LPKM1" << "\n" << name << "\n" << fileSize << "\n" << shards.size() << "\n";
+    for (const ShardEntry& shard : shards)
+    {
+        manifest << shard.offset << " " << shard.size << " " << shard.filename << "\n";
+    }
+
+    std::cout << "File split successfully to " << manifestFilename << endl;
+}
+
+// Manifest layout, one value per line: "LPKM1", the original file name, its size,
+// the shard count, then "<offset> <size> <shard file>" for every shard. Both
+// names are relative to the manifest's own directory.
+Manifest readManifest(const string& manifestFilename)
+{
+    ifstream file(manifestFilename);
+    if (!file)
+    {
+        throw runtime_error("Could not open file");
+    }
 
-            vector<unsigned char> data = readFile(arg2);
-            vector<unsigned char> packedData(((data.size() + 7) + length) + passwordLength);
+    Manifest manifest;
+    string magic;
+    size_t count = 0;
+    getline(file, magic);
+    getline(file, manifest.filename);
+    file >> manifest.fileSize >> count;
+    if (!file || magic != "LPKM1" || manifest.filename.empty())
+    {
+        throw runtime_error("Not a LeafPack manifest");
+    }
 
-            packedData[0] = 0x4C; // 'L'
-            packedData[1] = 0x50; // 'P'
-            packedData[2] = 0x4B; // 'K'
-            packedData[3] = 0x31; // Version 1
+    string directory = directoryOf(manifestFilename);
+    manifest.filename = directory + baseNameOf(manifest.filename);
 
-            uint8_t bitter = generateRandom(0, 253);
-            uint8_t bitter2 = generateRandom(0, 253);// Binary literal (C++14)
-            uint8_t bitter3 = generateRandom(0, 253);// Binary literal (C++14)
-            uint8_t bitter4 = generateRandom(0, 253);// Binary literal (C++14)
-            packedData[4] = bitter;
-            packedData[5] = bitter2;
-            packedData[6] = bitter3;
-            packedData[7] = bitter4;
-            packedData[8] = length;
+    manifest.shards.resize(count);
+    uint64_t end = 0;
+    for (ShardEntry& shard : manifest.shards)
+    {
+        file >> shard.offset >> shard.size;
+        getline(file, shard.filename);
+        if (!file || shard.filename.size() < 2 || shard.offset != end || shard.offset + shard.size > manifest.fileSize)
+        {
+            throw runtime_error("Corrupt LeafPack manifest");
+        }
+        shard.filename = directory + baseNameOf(shard.filename.substr(1));
+        end += shard.size;
+    }
+    if (end != manifest.fileSize)
+    {
+        throw runtime_error("Corrupt LeafPack manifest");
+    }
+    return manifest;
+}
 
-            int hahahah = generateRandom(0, 4);
+// Makes sure every shard exists, is a packed file and holds at least its part of
+// the original file, before anything gets written. Shards never have a password,
+// so their flag byte is ignored; older builds set it to 0x45 now and then.
+void checkShards(const Manifest& manifest)
+{
+    vector<string> paths;
+    for (const ShardEntry& shard : manifest.shards)
+    {
+        paths.push_back(shard.filename);
+    }
 
-            packedData[9] = generateRandom(0, 68);
+    vector<ArchiveInfo> infos = readArchiveInfos(paths);
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+        const ArchiveInfo& info = infos[i];
+        if (!info.error.empty())
+            throw runtime_error(info.path + ": " + info.error);
+        if (info.unpackedSize < manifest.shards[i].size + SHARD_PADDING)
+            throw runtime_error(info.path + ": Shard is too short");
+    }
+}
 
-            uint8_t one = 0x00;
-            uint8_t two = 0x00;
-          
+PooledBuffer unpackShard(const ShardEntry& shard)
+{
+    PooledBuffer data = readFile(shard.filename);
+    checkPackedData(data);
 
-            split16To8(crc16(password), one, two);
+    PooledBuffer unpackedData;
+    unpackData(data, data[4], unpackedData);
+    if (unpackedData.size() < shard.size)
+    {
+        throw runtime_error("Shard is too short");
+    }
+    return unpackedData;
+}
 
-            bitter = one;
-            bitter2 = two;
-            bitter3 = crc8(password);
-            bitter4 = (passcheckumbytes[1] >> 4) | (passcheckumbytes[1] << 4);
-            //printf("key 0x%02X\n", bitter);
+void joinShards(const string& manifestFilename)
+{
+    Manifest manifest = readManifest(manifestFilename);
+    checkShards(manifest);
 
-            std::string bitsBinKey = byteToBinaryString(bitter);
-            std::string bitsBinKey2 = byteToBinaryString(bitter2);
-            std::string bitsBinKey3 = byteToBinaryString(bitter3);
-            std::string bitsBinKey4 = byteToBinaryString(bitter4);
+    std::cout << "Unpacking " << manifest.shards.size() << " shards..." << endl;
 
-            //std::cout << "whaat? " << bitsBinKey << endl;
+    // Build the output under a temporary name, preallocated so every shard can be
+    // written in place, and only replace the real file once all shards are in.
+    string tempFilename = manifest.filename + ".part";
+    {
+        ofstream file(tempFilename, ios::binary | ios::trunc);
+        if (!file)
+        {
+            throw runtime_error("Could not create file");
+        }
+        if (manifest.fileSize > 0)
+        {
+            file.seekp(static_cast<streamoff>(manifest.fileSize - 1), ios::beg);
+            file.put(0);
+        }
+    }
 
-            int hihihi = 0;
+    try
+    {
+        uint64_t shardSize = 0;
+        for (const ShardEntry& shard : manifest.shards)
+        {
+            shardSize = max(shardSize, shard.size);
+        }
 
-            // std::cout << "Key bits: " << bitsBinKey << endl;
+        forEachShard(manifest.shards, shardSize, [&](size_t i)
+        {
+            const ShardEntry& shard = manifest.shards[i];
+            PooledBuffer unpackedData = unpackShard(shard);
+            writeFileRange(tempFilename, shard.offset, unpackedData.data(), static_cast<size_t>(shard.size));
+        });
+    }
+    catch (...)
+    {
+        remove(tempFilename.c_str());
+        throw;
+    }
 
-            std::cout << "Packing file..." << endl;
+    remove(manifest.filename.c_str());
+    if (rename(tempFilename.c_str(), manifest.filename.c_str()) != 0)
+    {
+        throw runtime_error("Could not create file");
+    }
 
-            for (int i = 10; i < (length + 10 + passwordLength) - 1; i += 32)
-            {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= ((10 + length) + passwordLength))
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = swapNibbles(x, arg2[(i + x) - 10]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = swapNibbles(0, arg2[(i + x) - 10]);
-                    }
-
-                    packedData[i + x] = byter;
-                }
-            }
+    std::cout << "File unpacked successfully to " << manifest.filename << endl;
+}
 
-            for (int i = 9 + length; i < (data.size() + 9) + length + passwordLength; i += 32)
-            {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= data.size() + (9 + length + passwordLength))
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = swapNibbles(x, data[(i + x) - (9 + length)]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = swapNibbles(0, data[(i + x) - (9 + length)]);
-                    }
-
-                    packedData[i + x] = byter;
-                }
-            }
-            packedData[packedData.size() - 4] = passcheckumbytes[0];
-            packedData[packedData.size() - 3] = passcheckumbytes[1];
-            packedData[packedData.size() - 2] = passcheckumbytes[2];
-            packedData[packedData.size() - 1] = passcheckumbytes[3];
+// Unpacks single shards of a manifest to "<name>.NNN" holding exactly their part
+// of the original file, so separately unpacked shards can simply be concatenated.
+void unpackShards(const string& manifestFilename, const vector<size_t>& indices)
+{
+    Manifest manifest = readManifest(manifestFilename);
+    for (size_t index : indices)
+    {
+        if (index >= manifest.shards.size())
+        {
+            throw runtime_error("No shard " + to_string(index) + " in " + manifestFilename);
+        }
 
-            // Save the packed data
-            string outputFilename = getOutputFilename(arg2);
-            writeFile(outputFilename, packedData);
-            std::cout << "File packed successfully to " << outputFilename << endl;
+        const ShardEntry& shard = manifest.shards[index];
+        std::cout << "Unpacking shard " << index << "..." << endl;
+        PooledBuffer unpackedData;
+        try
+        {
+            unpackedData = unpackShard(shard);
         }
         catch (const exception& e)
         {
-            cerr << "Error: " << e.what() << endl;
-            return 1;
+            throw runtime_error(shard.filename + ": " + e.what());
         }
+
+        string filename = getShardName(manifest.filename, index);
+        writeFile(filename, unpackedData.data(), static_cast<size_t>(shard.size));
+        std::cout << "File unpacked successfully to " << filename << endl;
     }
-    else if (std::string(argv[1]) == "-d" || globalmode == 1)
+}
+
+bool endsWith(const string& text, const string& suffix)
+{
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+void printUsage()
+{
+    cerr << "Usage: leafpack <argument> <inputfile> [inputfile...]" << endl;
+    cerr << "Options:" << endl;
+
+    cerr << "  -p : Pack the input file" << endl;
+    cerr << "  -pp : Pack the input file with a password" << endl;
+    cerr << "  -d : Unpack the input file (a .lpkm manifest rebuilds a split file)" << endl;
+    cerr << "  -s <MB> : Split the input file into packed shards of <MB> megabytes" << endl;
+    cerr << "  -ds <manifest> <shard...> : Unpack single shards of a split file" << endl;
+    cerr << "      (-d on a shard file itself leaves 6 bytes of padding at the end)" << endl;
+    cerr << "  --check-password : Check a password against the packed files without unpacking them" << endl;
+    cerr << "  -l : List what the packed files contain" << endl;
+    cerr << "  -lj : Same as -l, as JSON" << endl;
+    cerr << "  --stats : Report buffer allocations when done" << endl;
+    std::string hi;
+    std::getline(std::cin, hi);
+}
+
+int main(int argc, char* argv[])
+{
+    generate_crc32_table();
+
+    // --stats can go anywhere on the command line.
+    bool showStats = false;
+    int argCount = 1;
+    for (int i = 1; i < argc; i++)
     {
-        std::cout << "Unpack file:" << endl;
-        generate_crc8_table();
-        try
-        {
+        if (std::string(argv[i]) == "--stats")
+            showStats = true;
+        else
+            argv[argCount++] = argv[i];
+    }
+    argc = argCount;
+    string appmode = "";
 
-            vector<unsigned char> data;
-            if (globalmode == 1)
-                data = readFile(argv[1]);
-            else
-                data = readFile(argv[2]);
+    if (globalmode == 1)
+    {
+        appmode = "(unpack mode)";
+    }
+    else if (globalmode == 2)
+    {
+        appmode = "(pack mode)";
+    }
+    // Keep JSON listings clean for whatever reads them.
+    if (argc < 2 || std::string(argv[1]) != "-lj")
+    {
+        std::cout << "LeafPack (https://github.com/greensci/leafpack)\nby greensci (https://github.com/greensci)\n" << appmode << endl;
+    }
 
-            size_t length = data[8]; // Now you can use .size()
 
-            vector<unsigned char> unpackedData(data.size() - (7 + length));
+    if (argc < 2)
+    {
+        printUsage();
+        return 1;
+    }
+  
+
+    if (std::string(argv[1]).find(".lpk") != std::string::npos)
+    {
+        globalmode = 1;
+    }
+    else if (std::string(argv[1]) == "-p")
+    {
+    }
+    else if (std::string(argv[1]) == "-pp")
+    {
+    }
+    else if (std::string(argv[1]) == "-d")
+    {
+    }
+    else if (std::string(argv[1]) == "-s")
+    {
+    }
+    else if (std::string(argv[1]) == "-ds")
+    {
+    }
+    else if (std::string(argv[1]) == "--check-password")
+    {
+    }
+    else if (std::string(argv[1]) == "-l" || std::string(argv[1]) == "-lj")
+    {
+    }
+    else
+    {
+        globalmode = 2;
+    }
 
-            // Use the same key byte position (4) as in the unpacker
+    // Files dropped onto the exe come in as the arguments themselves.
+    vector<string> inputs(argv + (globalmode == 0 ? 2 : 1), argv + argc);
+    if (inputs.empty())
+    {
+        printUsage();
+        return 1;
+    }
 
-            uint8_t bitter = data[4];
-            uint8_t bitter2 = data[5];// Binary literal (C++14)
-            uint8_t bitter3 = data[6];// Binary literal (C++14
-            uint8_t bitter4 = data[7];// Binary literal (C++14)
-            // std::cout << "Key bits: " << bitsBinKey << endl;
-            string filename = "";
-            uint8_t one = 0x00;
-            uint8_t two = 0x00;
+    uint64_t shardSize = 0;
+    if (std::string(argv[1]) == "-s")
+    {
+        char* end = nullptr;
+        uint64_t megabytes = strtoull(inputs[0].c_str(), &end, 10);
+        if (*end == '\0' && megabytes <= UINT64_MAX / (1024 * 1024))
+            shardSize = megabytes * 1024 * 1024;
+        inputs.erase(inputs.begin());
+        if (shardSize == 0 || inputs.empty())
+        {
+            printUsage();
+            return 1;
+        }
+    }
 
-           
-            if (data[9] <= 0x45)
+    vector<size_t> shardIndices;
+    if (std::string(argv[1]) == "-ds")
+    {
+        for (size_t i = 1; i < inputs.size(); i++)
+        {
+            char* end = nullptr;
+            size_t index = static_cast<size_t>(strtoull(inputs[i].c_str(), &end, 10));
+            if (inputs[i].empty() || *end != '\0')
             {
-                std::string password;
-                std::cout << "Enter a password for the packed file: \n";
-                std::getline(std::cin, password);
-
-                uint32_t passchecksum = crc32(password);
-
-                uint8_t* passcheckumbytes = split32To8(passchecksum);
-
-               // std::cout << "Checksum: " << passchecksum << endl;
-                split16To8(crc16(password), one, two);
-
-                bitter = one;
-                bitter2 = two;
-                bitter3 = crc8(password);
-                bitter4 = (passcheckumbytes[1] << 4) | (passcheckumbytes[1] >> 4);
-
-               
-
-                if (data[data.size() - 4] == passcheckumbytes[0] &&
-                    data[data.size() - 3] == passcheckumbytes[1] &&
-                    data[data.size() - 2] == passcheckumbytes[2] &&
-                    data[data.size() - 1] == passcheckumbytes[3])
-                {
-                    std::cout << "Password is correct, unpacking..." << endl;
-                }
-                else
-                {
-                    std::cout << "Password is incorrect, aborting unpacking." << endl;
-                    return 1;
-                }
+                shardIndices.clear();
+                break;
             }
+            shardIndices.push_back(index);
+        }
+        if (shardIndices.empty())
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    int result = 0;
 
+    if (std::string(argv[1]) == "-l" || std::string(argv[1]) == "-lj")
+    {
+        vector<ArchiveInfo> infos = readArchiveInfos(inputs);
+        printArchiveInfos(infos, std::string(argv[1]) == "-lj");
+        for (const ArchiveInfo& info : infos)
+        {
+            if (!info.error.empty())
+                return 1;
+        }
+        return 0;
+    }
 
-            string bitsBinKey = byteToBinaryString(bitter);
-            string bitsBinKey2 = byteToBinaryString(bitter2);
-            string bitsBinKey3 = byteToBinaryString(bitter3);
-            string bitsBinKey4 = byteToBinaryString(bitter4);
-            std::cout << "Unpacking file..." << endl;
+    if (std::string(argv[1]) == "-p" || globalmode == 2)
+    {
+        std::cout << "Pack file:" << endl;
 
-            for (int i = 10; i < (data[8] + 10) - 1; i += 32)
+        for (const string& input : inputs)
+        {
+            try
+            {
+                packFile(input, false, "");
+            }
+            catch (const exception& e)
             {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= (10 + data[8]) - 1)
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = reswapNibbles(x, data[i + x]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = reswapNibbles(0, data[i + x]);
-                    }
-
-                    filename += byter;
-                }
+                cerr << "Error: " << e.what() << endl;
+                result = 1;
             }
-            //std::cout << "Filename: " << filename << endl;
+        }
+    }
+    else if (std::string(argv[1]) == "-pp")
+    {
+        std::cout << "Pack file with password:" << endl;
+        generate_crc8_table();
 
-            for (int i = 9 + length; i < data.size() - 4; i += 32)
+        std::string password;
+        std::cout << "Enter a password for the packed file: \n";
+        std::getline(std::cin, password);
+
+        for (const string& input : inputs)
+        {
+            try
             {
-                for (int x = 0; x < 32; x++)
-                {
-                    if (i + x >= data.size() - 4)
-                    {
-                        continue; // Avoid out-of-bounds access
-                    }
-                    string bits;
-                    if (x > 23) {
-                        bits = bitsBinKey4;
-                    }
-                    else if (x > 15) {
-                        bits = bitsBinKey3;
-                    }
-                    else if (x > 7) {
-                        bits = bitsBinKey2;
-                    }
-                    else {
-                        bits = bitsBinKey;
-                    }
-                    unsigned char byter = 0x00;
-                    if (bits[x] == '1')
-                    {
-                        // Apply the inverse operation for this mode
-                        byter = reswapNibbles(x, data[(i + x)]);
-                    }
-                    else
-                    {
-                        // Mode 0 is its own inverse
-                        byter = reswapNibbles(0, data[(i + x)]);
-                    }
-
-                    unpackedData[(i + x) - (9 + length)] = byter;
-                }
+                packFile(input, true, password);
             }
+            catch (const exception& e)
+            {
+                cerr << "Error: " << e.what() << endl;
+                result = 1;
+            }
+        }
+    }
+    else if (std::string(argv[1]) == "--check-password")
+    {
+        std::cout << "Check password:" << endl;
+        generate_crc8_table();
+
+        std::string password;
+        std::cout << "Enter the password to check: \n";
+        std::getline(std::cin, password);
 
-            // Save the packed data
+        if (!checkPassword(inputs, password))
+            result = 1;
+    }
+    else if (std::string(argv[1]) == "-s")
+    {
+        std::cout << "Split file:" << endl;
+
+        for (const string& input : inputs)
+        {
+            try
+            {
+                splitFile(input, shardSize);
+            }
+            catch (const exception& e)
+            {
+                cerr << "Error: " << e.what() << endl;
+                result = 1;
+            }
+        }
+    }
+    else if (std::string(argv[1]) == "-ds")
+    {
+        std::cout << "Unpack shards:" << endl;
 
-            writeFile(filename, unpackedData);
-            std::cout << "File unpacked successfully to " << filename << endl;
+        try
+        {
+            unpackShards(inputs[0], shardIndices);
         }
         catch (const exception& e)
         {
             cerr << "Error: " << e.what() << endl;
-            return 1;
+            result = 1;
         }
     }
-    else
+    else if (std::string(argv[1]) == "-d" || globalmode == 1)
     {
-       
-        cerr << "Usage: leafpack <argument> <inputfile>" << endl;
-        cerr << "Options:" << endl;
+        std::cout << "Unpack file:" << endl;
+        generate_crc8_table();
 
-        cerr << "  -p : Pack the input file" << endl;
-        cerr << "  -d : Unpack the input file" << endl;
-        std::string hi;
-        std::getline(std::cin, hi);
+        for (const string& input : inputs)
+        {
+            try
+            {
+                if (endsWith(input, ".lpkm"))
+                    joinShards(input);
+                else if (!unpackFile(input))
+                    result = 1;
+            }
+            catch (const exception& e)
+            {
+                cerr << "Error: " << e.what() << endl;
+                result = 1;
+            }
+        }
+    }
+    else
+    {
+        printUsage();
         return 1;
     }
 
-    return 0;
+    if (showStats)
+    {
+        cerr << "Buffers: " << bufferPool.allocations() << " allocated, "
+             << bufferPool.reuses() << " reused" << endl;
+    }
+
+    return result;
 }
\ No newline at end of file